@@ -1,6 +1,10 @@
 #include <assert.h>
+#include <math.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include "heatsim.h"
 #include "log.h"
 
@@ -14,6 +18,476 @@ struct buffer_t
 // static MPI_Datatype buffer_type;
 // static MPI_Datatype data_buffer_type;
 
+/*
+ * Échange des bordures par mémoire partagée entre les rangs d'un même noeud
+ * (activé avec HEATSIM_SHARED_EXCHANGE=1). Chaque rang copie une fois ses
+ * bordures dans son segment d'une fenêtre `MPI_Win_allocate_shared`; les
+ * voisins du même noeud les lisent directement, sans message MPI. Deux
+ * tranches alternent d'une étape à l'autre. La synchronisation se fait
+ * seulement entre voisins: l'en-tête de chaque segment indique l'étape
+ * publiée dans chaque tranche et la dernière étape lue de chaque voisin.
+ * Le programme doit appeler `heatsim_shared_exchange_finalize` avant
+ * `MPI_Finalize` pour fermer l'époque d'accès et libérer la fenêtre.
+ */
+enum shared_direction
+{
+    SHARED_NORTH,
+    SHARED_SOUTH,
+    SHARED_EAST,
+    SHARED_WEST,
+    SHARED_DIRECTIONS
+};
+
+struct shared_header_t
+{
+    volatile long published[2];
+    volatile long consumed[SHARED_DIRECTIONS];
+};
+
+struct shared_peer_t
+{
+    int node_rank;
+    struct shared_header_t* header;
+    double* borders;
+};
+
+struct shared_exchange_t
+{
+    bool enabled;
+    bool allocated;
+    MPI_Comm node_communicator;
+    MPI_Win window;
+    unsigned int max_width;
+    unsigned int max_height;
+    long step;
+    struct shared_header_t* header;
+    double* borders;
+    struct shared_peer_t peers[SHARED_DIRECTIONS];
+};
+
+static struct shared_exchange_t shared_exchange = {.enabled = false, .allocated = false};
+
+// Niveau de support des fils d'exécution fourni par `MPI_Init_thread`
+static int thread_level = MPI_THREAD_SINGLE;
+
+/*
+ * Critère d'arrêt optionnel (HEATSIM_TOLERANCE, vérifié toutes les
+ * HEATSIM_CHECK_INTERVAL étapes). Le résidu global est le maximum des
+ * variations locales, réduit avec `MPI_Iallreduce` et attendu seulement à
+ * l'étape suivante, après son échange de bordures. Le programme doit
+ * appeler `heatsim_check_convergence_finish` après la dernière étape pour
+ * compléter une réduction encore en cours avant `MPI_Finalize`.
+ */
+struct convergence_t
+{
+    double tolerance;
+    unsigned int interval;
+    unsigned int step;
+    bool pending;
+    double local_residual;
+    double global_residual;
+    MPI_Request request;
+};
+
+static struct convergence_t convergence = {.tolerance = 0, .interval = 10, .pending = false};
+
+/*
+ * Profilage par rang (HEATSIM_PROFILE=1). Chaque région cumule son temps
+ * avec `MPI_Wtime`; `heatsim_profile_report` agrège min/moy/max et le
+ * déséquilibre sur le rang 0, ainsi que le nombre moyen d'appels par rang
+ * et le temps moyen par appel. Avec HEATSIM_TRACE=<préfixe>, chaque rang
+ * écrit aussi ses intervalles dans `<préfixe>.<rang>`. En mode hybride,
+ * l'échange est recouvert par le calcul et compté dans les deux régions.
+ * La ligne `total` est le temps écoulé depuis `heatsim_init`, sans le
+ * lancement de `mpirun`.
+ */
+enum heatsim_region
+{
+    REGION_COMPUTE,
+    REGION_EXCHANGE,
+    REGION_DISTRIBUTE,
+    REGION_COLLECT,
+    REGION_TOTAL,
+    REGION_COUNT
+};
+
+static const char* region_names[REGION_COUNT] = {"compute", "exchange", "distribute", "collect", "total"};
+
+struct profile_t
+{
+    bool enabled;
+    double origin;
+    double total[REGION_COUNT];
+    unsigned long count[REGION_COUNT];
+    FILE* trace;
+};
+
+static struct profile_t profile = {.enabled = false, .trace = NULL};
+
+static double profile_begin(void) {
+    return profile.enabled ? MPI_Wtime() : 0;
+}
+
+static void profile_end(enum heatsim_region region, double start) {
+    if (!profile.enabled) {
+        return;
+    }
+    double end = MPI_Wtime();
+    profile.total[region] += end - start;
+    profile.count[region]++;
+    if (profile.trace != NULL) {
+        fprintf(profile.trace, "%s %.9f %.9f\n", region_names[region], start - profile.origin, end - profile.origin);
+    }
+}
+
+static int profile_init(heatsim_t* heatsim) {
+    profile.enabled = true;
+    profile.origin = MPI_Wtime();
+
+    const char* trace = getenv("HEATSIM_TRACE");
+    if (trace != NULL && trace[0] != '\0') {
+        char path[256];
+        snprintf(path, sizeof(path), "%s.%d", trace, heatsim->rank);
+        profile.trace = fopen(path, "w");
+        if (profile.trace == NULL) {
+		    printf("error fopen %s", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static bool env_flag(const char* name) {
+    const char* value = getenv(name);
+    return value != NULL && strcmp(value, "0") != 0 && strcmp(value, "") != 0;
+}
+
+static size_t shared_slot_size(void) {
+    return 2 * (size_t)shared_exchange.max_width + 2 * (size_t)shared_exchange.max_height;
+}
+
+static enum shared_direction shared_opposite(enum shared_direction direction) {
+    switch (direction) {
+    case SHARED_NORTH: return SHARED_SOUTH;
+    case SHARED_SOUTH: return SHARED_NORTH;
+    case SHARED_EAST: return SHARED_WEST;
+    default: return SHARED_EAST;
+    }
+}
+
+// Bordures d'une tranche: nord [max_width], sud [max_width], ouest [max_height], est [max_height]
+static double* shared_border(double* borders, long step, enum shared_direction direction) {
+    double* slot = borders + (step % 2) * shared_slot_size();
+    switch (direction) {
+    case SHARED_NORTH: return slot;
+    case SHARED_SOUTH: return slot + shared_exchange.max_width;
+    case SHARED_WEST: return slot + 2 * shared_exchange.max_width;
+    default: return slot + 2 * shared_exchange.max_width + shared_exchange.max_height;
+    }
+}
+
+/*
+ * Attente active sur un drapeau d'un voisin. Après quelques essais, le fil
+ * cède le processeur pour ne pas bloquer le voisin lorsque les rangs sont
+ * plus nombreux que les coeurs.
+ */
+static void shared_spin(unsigned int* spins) {
+    MPI_Win_sync(shared_exchange.window);
+    if (++*spins > 64) {
+        sched_yield();
+    }
+}
+
+static bool shared_on_node(enum shared_direction direction) {
+    return shared_exchange.enabled && shared_exchange.peers[direction].header != NULL;
+}
+
+static int shared_exchange_init(heatsim_t* heatsim) {
+    int err;
+    MPI_Group cart_group;
+    MPI_Group node_group;
+
+    err = MPI_Comm_split_type(heatsim->communicator, MPI_COMM_TYPE_SHARED, heatsim->rank, MPI_INFO_NULL, &shared_exchange.node_communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Comm_split_type");
+        goto fail_exit; 
+    }
+
+    err = MPI_Comm_group(heatsim->communicator, &cart_group);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Comm_group cart");
+        goto fail_exit; 
+    }
+    err = MPI_Comm_group(shared_exchange.node_communicator, &node_group);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Comm_group node");
+        goto fail_exit; 
+    }
+
+    int peers[4] = {heatsim->rank_north_peer, heatsim->rank_south_peer, heatsim->rank_east_peer, heatsim->rank_west_peer};
+    int node_peers[4];
+    err = MPI_Group_translate_ranks(cart_group, 4, peers, node_group, node_peers);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Group_translate_ranks");
+        goto fail_exit; 
+    }
+    shared_exchange.peers[SHARED_NORTH].node_rank = node_peers[0];
+    shared_exchange.peers[SHARED_SOUTH].node_rank = node_peers[1];
+    shared_exchange.peers[SHARED_EAST].node_rank = node_peers[2];
+    shared_exchange.peers[SHARED_WEST].node_rank = node_peers[3];
+
+    MPI_Group_free(&cart_group);
+    MPI_Group_free(&node_group);
+
+    shared_exchange.enabled = true;
+    shared_exchange.allocated = false;
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+static int shared_query_segment(struct shared_peer_t* peer) {
+    MPI_Aint size;
+    int disp_unit;
+
+    peer->header = NULL;
+    peer->borders = NULL;
+    if (peer->node_rank == MPI_UNDEFINED) {
+        return 0;
+    }
+    if (MPI_Win_shared_query(shared_exchange.window, peer->node_rank, &size, &disp_unit, &peer->header) != MPI_SUCCESS) {
+		printf("error MPI_Win_shared_query");
+        peer->header = NULL;
+        return -1;
+    }
+    peer->borders = (double*)(peer->header + 1);
+    return 0;
+}
+
+/*
+ * Allocation paresseuse de la fenêtre au premier échange, lorsque les
+ * dimensions des `grid` sont connues. Tous les segments ont la même
+ * disposition (dimensions maximales du noeud). Un échec sur un rang est
+ * propagé à tout le noeud: sinon un rang enverrait par MPI à un voisin qui
+ * lit la fenêtre, et l'échange bloquerait.
+ */
+static int shared_exchange_allocate(grid_t* grid) {
+    int err;
+    unsigned int local_dims[2] = {grid->width, grid->height};
+    unsigned int max_dims[2];
+
+    err = MPI_Allreduce(local_dims, max_dims, 2, MPI_UNSIGNED, MPI_MAX, shared_exchange.node_communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Allreduce shared dims");
+        goto fail_exit; 
+    }
+    shared_exchange.max_width = max_dims[0];
+    shared_exchange.max_height = max_dims[1];
+    shared_exchange.step = 0;
+
+    MPI_Aint size = sizeof(struct shared_header_t) + 2 * shared_slot_size() * sizeof(double);
+    err = MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, shared_exchange.node_communicator, &shared_exchange.header, &shared_exchange.window);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Win_allocate_shared");
+        goto fail_exit; 
+    }
+
+    int local_ok = 1;
+    bool locked = false;
+    err = MPI_Win_lock_all(MPI_MODE_NOCHECK, shared_exchange.window);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Win_lock_all");
+        local_ok = 0;
+    } else {
+        locked = true;
+    }
+
+    for (int direction = 0; direction < SHARED_DIRECTIONS && local_ok; direction++) {
+        if (shared_query_segment(&shared_exchange.peers[direction]) < 0) {
+            local_ok = 0;
+        }
+    }
+
+    int node_ok;
+    err = MPI_Allreduce(&local_ok, &node_ok, 1, MPI_INT, MPI_MIN, shared_exchange.node_communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Allreduce shared status");
+        node_ok = 0;
+    }
+    if (!node_ok) {
+        goto fail_free;
+    }
+
+    //Headers must be initialised before any neighbour reads them
+    shared_exchange.borders = (double*)(shared_exchange.header + 1);
+    shared_exchange.header->published[0] = -1;
+    shared_exchange.header->published[1] = -1;
+    for (int direction = 0; direction < SHARED_DIRECTIONS; direction++) {
+        shared_exchange.header->consumed[direction] = -1;
+    }
+    MPI_Win_sync(shared_exchange.window);
+    err = MPI_Barrier(shared_exchange.node_communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Barrier node");
+        goto fail_free;
+    }
+    MPI_Win_sync(shared_exchange.window);
+
+    shared_exchange.allocated = true;
+    return 0;
+
+fail_free:
+    if (locked) {
+        MPI_Win_unlock_all(shared_exchange.window);
+    }
+    MPI_Win_free(&shared_exchange.window);
+fail_exit:
+    return -1;
+}
+
+static void shared_pack_column(grid_t* grid, int x, double* border) {
+    for (unsigned int y = 0; y < grid->height; y++) {
+        border[y] = *grid_get_cell(grid, x, y);
+    }
+}
+
+static void shared_unpack_column(grid_t* grid, int x, const double* border) {
+    for (unsigned int y = 0; y < grid->height; y++) {
+        *grid_get_cell(grid, x, y) = border[y];
+    }
+}
+
+/*
+ * Copie les bordures lues par les voisins du noeud dans la tranche de
+ * l'étape courante, après que ces voisins ont fini de lire cette tranche
+ * deux étapes plus tôt, puis publie l'étape.
+ */
+static void shared_exchange_publish(grid_t* grid) {
+    long step = shared_exchange.step;
+
+    assert(grid->width <= shared_exchange.max_width);
+    assert(grid->height <= shared_exchange.max_height);
+
+    for (int direction = 0; direction < SHARED_DIRECTIONS; direction++) {
+        struct shared_peer_t* peer = &shared_exchange.peers[direction];
+        if (peer->header == NULL) {
+            continue;
+        }
+        unsigned int spins = 0;
+        while (peer->header->consumed[shared_opposite(direction)] < step - 2) {
+            shared_spin(&spins);
+        }
+    }
+    MPI_Win_sync(shared_exchange.window);
+
+    double* borders = shared_exchange.borders;
+    if (shared_on_node(SHARED_NORTH)) {
+        memcpy(shared_border(borders, step, SHARED_NORTH), grid_get_cell(grid, 0, grid->height-1), grid->width * sizeof(double));
+    }
+    if (shared_on_node(SHARED_SOUTH)) {
+        memcpy(shared_border(borders, step, SHARED_SOUTH), grid_get_cell(grid, 0, 0), grid->width * sizeof(double));
+    }
+    if (shared_on_node(SHARED_WEST)) {
+        shared_pack_column(grid, 0, shared_border(borders, step, SHARED_WEST));
+    }
+    if (shared_on_node(SHARED_EAST)) {
+        shared_pack_column(grid, grid->width-1, shared_border(borders, step, SHARED_EAST));
+    }
+
+    MPI_Win_sync(shared_exchange.window);
+    shared_exchange.header->published[step % 2] = step;
+    MPI_Win_sync(shared_exchange.window);
+}
+
+// Attend que les voisins du noeud aient publié l'étape courante
+static void shared_exchange_wait(void) {
+    long step = shared_exchange.step;
+
+    for (int direction = 0; direction < SHARED_DIRECTIONS; direction++) {
+        struct shared_peer_t* peer = &shared_exchange.peers[direction];
+        if (peer->header == NULL) {
+            continue;
+        }
+        unsigned int spins = 0;
+        while (peer->header->published[step % 2] != step) {
+            shared_spin(&spins);
+        }
+    }
+    MPI_Win_sync(shared_exchange.window);
+}
+
+// Bordure publiée par le voisin dans `direction`, qui remplace le rembourrage de ce côté
+static const double* shared_exchange_ghost(enum shared_direction direction) {
+    struct shared_peer_t* peer = &shared_exchange.peers[direction];
+    return shared_border(peer->borders, shared_exchange.step, shared_opposite(direction));
+}
+
+static void shared_exchange_unpack(grid_t* grid) {
+    if (shared_on_node(SHARED_NORTH)) {
+        memcpy(grid_get_cell(grid, 0, grid->height), shared_exchange_ghost(SHARED_NORTH), grid->width * sizeof(double));
+    }
+    if (shared_on_node(SHARED_SOUTH)) {
+        memcpy(grid_get_cell(grid, 0, -1), shared_exchange_ghost(SHARED_SOUTH), grid->width * sizeof(double));
+    }
+    if (shared_on_node(SHARED_WEST)) {
+        shared_unpack_column(grid, -1, shared_exchange_ghost(SHARED_WEST));
+    }
+    if (shared_on_node(SHARED_EAST)) {
+        shared_unpack_column(grid, grid->width, shared_exchange_ghost(SHARED_EAST));
+    }
+}
+
+// Signale aux voisins que la tranche de l'étape courante a été lue
+static void shared_exchange_release(void) {
+    if (!shared_exchange.enabled || !shared_exchange.allocated) {
+        return;
+    }
+    MPI_Win_sync(shared_exchange.window);
+    for (int direction = 0; direction < SHARED_DIRECTIONS; direction++) {
+        if (shared_exchange.peers[direction].header != NULL) {
+            shared_exchange.header->consumed[direction] = shared_exchange.step;
+        }
+    }
+    MPI_Win_sync(shared_exchange.window);
+    shared_exchange.step++;
+}
+
+int heatsim_shared_exchange_finalize(void) {
+    /*
+     * Collectif sur les rangs du noeud. Sans effet si l'échange par mémoire
+     * partagée n'est pas activé.
+     */
+    int err;
+
+    if (shared_exchange.allocated) {
+        err = MPI_Win_unlock_all(shared_exchange.window);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Win_unlock_all");
+            goto fail_exit; 
+        }
+        err = MPI_Win_free(&shared_exchange.window);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Win_free");
+            goto fail_exit; 
+        }
+        shared_exchange.allocated = false;
+    }
+
+    if (shared_exchange.enabled) {
+        err = MPI_Comm_free(&shared_exchange.node_communicator);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Comm_free node");
+            goto fail_exit; 
+        }
+        shared_exchange.enabled = false;
+    }
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
 
 MPI_Datatype create_buffer_type() {
     int err;
@@ -46,13 +520,7 @@ MPI_Datatype create_data_type(int size) {
 }
 
 
-int heatsim_init(heatsim_t* heatsim, unsigned int dim_x, unsigned int dim_y) {
-    /*
-     * TODO: Initialiser tous les membres de la structure `heatsim`.
-     *       Le communicateur doit être périodique. Le communicateur
-     *       cartésien est périodique en X et Y.
-     */
-    
+static int heatsim_init_world(heatsim_t* heatsim) {
     int err;
     err = MPI_Comm_rank(MPI_COMM_WORLD, &heatsim->rank);
     if (err != MPI_SUCCESS) {
@@ -64,14 +532,26 @@ int heatsim_init(heatsim_t* heatsim, unsigned int dim_x, unsigned int dim_y) {
 		printf("error MPI_Comm_size");
         goto fail_exit; 
     }
-    int dim[2] = {dim_x,dim_y};
+    return 0;
+fail_exit:
+    return -1;
+}
+
+static int heatsim_init_cart(heatsim_t* heatsim, int dim[2], bool reorder) {
+    int err;
     int periodics[2] = {1, 1};
     
-    err = MPI_Cart_create(MPI_COMM_WORLD, 2, dim, periodics, false, &heatsim->communicator);
+    err = MPI_Cart_create(MPI_COMM_WORLD, 2, dim, periodics, reorder, &heatsim->communicator);
     if (err != MPI_SUCCESS) {
 		printf("error MPI_Cart_create");
         goto fail_exit; 
     }
+    //The rank may change when reordering is allowed
+    err = MPI_Comm_rank(heatsim->communicator, &heatsim->rank);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Comm_rank cart");
+        goto fail_exit; 
+    }
     err = MPI_Cart_shift(heatsim->communicator, 0, 1, &heatsim->rank_west_peer, &heatsim->rank_east_peer);
     if (err != MPI_SUCCESS) {
 		printf("error MPI_CART_SHIFT west to east ");
@@ -88,14 +568,239 @@ int heatsim_init(heatsim_t* heatsim, unsigned int dim_x, unsigned int dim_y) {
         goto fail_exit; 
     }
 
+    err = MPI_Query_thread(&thread_level);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Query_thread");
+        goto fail_exit; 
+    }
+
+    const char* tolerance = getenv("HEATSIM_TOLERANCE");
+    if (tolerance != NULL) {
+        convergence.tolerance = strtod(tolerance, NULL);
+    }
+    const char* interval = getenv("HEATSIM_CHECK_INTERVAL");
+    if (interval != NULL && atoi(interval) > 0) {
+        convergence.interval = atoi(interval);
+    }
+
+    if (env_flag("HEATSIM_PROFILE") && profile_init(heatsim) < 0) {
+        goto fail_exit;
+    }
+
+    if (env_flag("HEATSIM_SHARED_EXCHANGE")) {
+        err = shared_exchange_init(heatsim);
+        if (err < 0) {
+            goto fail_exit;
+        }
+    }
+
+    return 0;
+fail_exit:
+    if (profile.trace != NULL) {
+        fclose(profile.trace);
+        profile.trace = NULL;
+    }
+    return -1;
+}
+
+int heatsim_init(heatsim_t* heatsim, unsigned int dim_x, unsigned int dim_y) {
+    /*
+     * TODO: Initialiser tous les membres de la structure `heatsim`.
+     *       Le communicateur doit être périodique. Le communicateur
+     *       cartésien est périodique en X et Y.
+     *
+     *       Une dimension nulle est choisie par `MPI_Dims_create`.
+     */
     
+    int err;
+    err = heatsim_init_world(heatsim);
+    if (err < 0) {
+        goto fail_exit;
+    }
+    int dim[2] = {dim_x,dim_y};
+    if (dim_x == 0 || dim_y == 0) {
+        err = MPI_Dims_create(heatsim->rank_count, 2, dim);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Dims_create");
+            goto fail_exit; 
+        }
+    }
+    return heatsim_init_cart(heatsim, dim, false);
+fail_exit:
+    return -1;
+}
+
+int heatsim_init_auto(heatsim_t* heatsim, unsigned int grid_width, unsigned int grid_height) {
+    /*
+     * Choisit la grille de processus à partir des dimensions de la `grid`
+     * globale. Pour une grille `dim_x` x `dim_y`, le périmètre échangé par
+     * rang est proportionnel à `grid_width / dim_x + grid_height / dim_y`,
+     * qu'on minimise parmi les factorisations de `rank_count`. En cas
+     * d'égalité, la proposition de `MPI_Dims_create` est conservée. Le
+     * communicateur est créé avec `reorder` pour que MPI place les voisins
+     * près les uns des autres.
+     */
+    int err;
+    err = heatsim_init_world(heatsim);
+    if (err < 0) {
+        goto fail_exit;
+    }
+
+    int dim[2] = {0, 0};
+    err = MPI_Dims_create(heatsim->rank_count, 2, dim);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Dims_create");
+        goto fail_exit; 
+    }
+
+    double best = INFINITY;
+    if ((unsigned int)dim[0] <= grid_width && (unsigned int)dim[1] <= grid_height) {
+        best = (double)grid_width / dim[0] + (double)grid_height / dim[1];
+    }
+    for (int dim_x = 1; dim_x <= heatsim->rank_count; dim_x++) {
+        if (heatsim->rank_count % dim_x != 0) {
+            continue;
+        }
+        int dim_y = heatsim->rank_count / dim_x;
+        if ((unsigned int)dim_x > grid_width || (unsigned int)dim_y > grid_height) {
+            continue;
+        }
+        double perimeter = (double)grid_width / dim_x + (double)grid_height / dim_y;
+        if (perimeter < best) {
+            best = perimeter;
+            dim[0] = dim_x;
+            dim[1] = dim_y;
+        }
+    }
+    if (best == INFINITY) {
+		printf("error heatsim_init_auto: %d ranks do not fit a %ux%u grid", heatsim->rank_count, grid_width, grid_height);
+        goto fail_exit; 
+    }
+
+    return heatsim_init_cart(heatsim, dim, true);
+fail_exit:
+    return -1;
+}
+
+/*
+ * Répartit `total` cellules entre `count` tranches proportionnellement à
+ * `weights` (plus grands restes), avec au moins une cellule par tranche.
+ */
+static void heatsim_apportion(unsigned int total, const double* weights, int count, unsigned int* extents) {
+    double weight_sum = 0;
+    for (int i = 0; i < count; i++) {
+        weight_sum += weights[i];
+    }
+
+    unsigned int assigned = 0;
+    unsigned int spare = total - count;
+    for (int i = 0; i < count; i++) {
+        extents[i] = 1 + (unsigned int)(spare * (weights[i] / weight_sum));
+        assigned += extents[i];
+    }
+
+    while (assigned < total) {
+        int best = 0;
+        double best_remainder = -1;
+        for (int i = 0; i < count; i++) {
+            double remainder = 1 + spare * (weights[i] / weight_sum) - extents[i];
+            if (remainder > best_remainder) {
+                best_remainder = remainder;
+                best = i;
+            }
+        }
+        extents[best]++;
+        assigned++;
+    }
+}
+
+int heatsim_balance_extents(heatsim_t* heatsim, double throughput,
+                            unsigned int grid_width, unsigned int grid_height,
+                            unsigned int* column_widths, unsigned int* row_heights) {
+    /*
+     * Calcule des sous-domaines inégaux à partir du débit mesuré de chaque
+     * rang (cellules par seconde). Chaque colonne de la grille de processus
+     * reçoit une largeur proportionnelle au débit cumulé de ses rangs, et
+     * chaque rangée une hauteur proportionnelle au sien. `column_widths` et
+     * `row_heights` doivent contenir `dim_x` et `dim_y` éléments; le
+     * résultat est identique sur tous les rangs.
+     *
+     * Limite: une décomposition cartésienne impose une largeur par colonne
+     * et une hauteur par rangée, donc seul un déséquilibre entre colonnes
+     * ou entre rangées est corrigé. Un écart entre rangs dont les sommes
+     * par colonne et par rangée sont égales (par exemple des débits
+     * [[1, 3], [3, 1]] sur une grille 2x2) donne des sous-domaines égaux.
+     */
+    int err;
+    double* throughputs = NULL;
+    double* column_weights = NULL;
+    double* row_weights = NULL;
+
+    int dim[2];
+    int periodics[2];
+    int coordinates[2];
+    err = MPI_Cart_get(heatsim->communicator, 2, dim, periodics, coordinates);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Cart_get");
+        goto fail_exit; 
+    }
+    if ((unsigned int)dim[0] > grid_width || (unsigned int)dim[1] > grid_height) {
+		printf("error heatsim_balance_extents: %dx%d ranks do not fit a %ux%u grid", dim[0], dim[1], grid_width, grid_height);
+        goto fail_exit;
+    }
+
+    throughputs = malloc(heatsim->rank_count * sizeof(double));
+    column_weights = calloc(dim[0], sizeof(double));
+    row_weights = calloc(dim[1], sizeof(double));
+    if (throughputs == NULL || column_weights == NULL || row_weights == NULL) {
+        LOG_ERROR_NULL_PTR();
+        goto fail_exit;
+    }
+
+    err = MPI_Allgather(&throughput, 1, MPI_DOUBLE, throughputs, 1, MPI_DOUBLE, heatsim->communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Allgather throughput");
+        goto fail_exit; 
+    }
+
+    //A rank that did not measure anything counts as the average of the others
+    double measured_sum = 0;
+    int measured_count = 0;
+    for (int rank = 0; rank < heatsim->rank_count; rank++) {
+        if (throughputs[rank] > 0) {
+            measured_sum += throughputs[rank];
+            measured_count++;
+        }
+    }
+    double average = measured_count > 0 ? measured_sum / measured_count : 1;
+
+    for (int rank = 0; rank < heatsim->rank_count; rank++) {
+        err = MPI_Cart_coords(heatsim->communicator, rank, 2, coordinates);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Cart_coords");
+            goto fail_exit; 
+        }
+        double weight = throughputs[rank] > 0 ? throughputs[rank] : average;
+        column_weights[coordinates[0]] += weight;
+        row_weights[coordinates[1]] += weight;
+    }
+
+    heatsim_apportion(grid_width, column_weights, dim[0], column_widths);
+    heatsim_apportion(grid_height, row_weights, dim[1], row_heights);
 
+    free(throughputs);
+    free(column_weights);
+    free(row_weights);
     return 0;
+
 fail_exit:
+    free(throughputs);
+    free(column_weights);
+    free(row_weights);
     return -1;
 }
 
-int heatsim_send_grids(heatsim_t* heatsim, cart2d_t* cart) {
+static int heatsim_send_grids_untimed(heatsim_t* heatsim, cart2d_t* cart) {
     /*
      * TODO: Envoyer toutes les `grid` aux autres rangs. Cette fonction
      *       est appelé pour le rang 0. Par exemple, si le rang 3 est à la
@@ -152,7 +857,14 @@ fail_exit:
     return -1;
 }
 
-grid_t* heatsim_receive_grid(heatsim_t* heatsim) {
+int heatsim_send_grids(heatsim_t* heatsim, cart2d_t* cart) {
+    double start = profile_begin();
+    int result = heatsim_send_grids_untimed(heatsim, cart);
+    profile_end(REGION_DISTRIBUTE, start);
+    return result;
+}
+
+static grid_t* heatsim_receive_grid_untimed(heatsim_t* heatsim) {
     /*
      * TODO: Recevoir un `grid ` du rang 0. Il est important de noté que
      *       toutes les `grid` ne sont pas nécessairement de la même
@@ -197,7 +909,14 @@ fail_exit:
     return NULL;
 }
 
-int heatsim_exchange_borders(heatsim_t* heatsim, grid_t* grid) {
+grid_t* heatsim_receive_grid(heatsim_t* heatsim) {
+    double start = profile_begin();
+    grid_t* result = heatsim_receive_grid_untimed(heatsim);
+    profile_end(REGION_DISTRIBUTE, start);
+    return result;
+}
+
+static int heatsim_exchange_borders_untimed(heatsim_t* heatsim, grid_t* grid, bool unpack) {
     assert(grid->padding == 1);
 
     /*
@@ -245,6 +964,26 @@ int heatsim_exchange_borders(heatsim_t* heatsim, grid_t* grid) {
     int err;
     MPI_Request request[8];
     MPI_Status status[8];
+    for (int i = 0; i < 8; i++) {
+        request[i] = MPI_REQUEST_NULL;
+    }
+
+    //Peers on the same node are exchanged through shared memory
+    bool north_remote = true;
+    bool south_remote = true;
+    bool east_remote = true;
+    bool west_remote = true;
+    if (shared_exchange.enabled) {
+        if (!shared_exchange.allocated && shared_exchange_allocate(grid) < 0) {
+            goto fail_exit;
+        }
+        north_remote = !shared_on_node(SHARED_NORTH);
+        south_remote = !shared_on_node(SHARED_SOUTH);
+        east_remote = !shared_on_node(SHARED_EAST);
+        west_remote = !shared_on_node(SHARED_WEST);
+        shared_exchange_publish(grid);
+    }
+
     //Send
 
     //Contiguous
@@ -259,17 +998,21 @@ int heatsim_exchange_borders(heatsim_t* heatsim, grid_t* grid) {
     MPI_Type_commit(&south_north_type);
 
     //North
-    err = MPI_Isend(grid_get_cell(grid, 0, grid->height-1), 1, south_north_type, heatsim->rank_north_peer, 1, heatsim->communicator, &request[0]);
-    if (err != MPI_SUCCESS) {
+    if (north_remote) {
+        err = MPI_Isend(grid_get_cell(grid, 0, grid->height-1), 1, south_north_type, heatsim->rank_north_peer, 1, heatsim->communicator, &request[0]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_ISEND north");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
     //South
-    err = MPI_Isend(grid_get_cell(grid, 0, 0), 1, south_north_type, heatsim->rank_south_peer, 0, heatsim->communicator, &request[1]);
-    if (err != MPI_SUCCESS) {
+    if (south_remote) {
+        err = MPI_Isend(grid_get_cell(grid, 0, 0), 1, south_north_type, heatsim->rank_south_peer, 0, heatsim->communicator, &request[1]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_ISEND south");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
     //Vector
@@ -284,50 +1027,71 @@ int heatsim_exchange_borders(heatsim_t* heatsim, grid_t* grid) {
     MPI_Type_commit(&east_west_type);
 
     //West
-    err = MPI_Isend(grid_get_cell(grid, 0, 0), 1, east_west_type, heatsim->rank_west_peer, 0, heatsim->communicator, &request[2]);
-    if (err != MPI_SUCCESS) {
+    if (west_remote) {
+        err = MPI_Isend(grid_get_cell(grid, 0, 0), 1, east_west_type, heatsim->rank_west_peer, 0, heatsim->communicator, &request[2]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_ISEND west");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
 
     //East
-    err = MPI_Isend(grid_get_cell(grid, grid->width-1, 0), 1, east_west_type, heatsim->rank_east_peer, 1, heatsim->communicator, &request[3]);
-    if (err != MPI_SUCCESS) {
+    if (east_remote) {
+        err = MPI_Isend(grid_get_cell(grid, grid->width-1, 0), 1, east_west_type, heatsim->rank_east_peer, 1, heatsim->communicator, &request[3]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_ISEND east");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
     //Receive
 
     //North
-    err = MPI_Irecv(grid_get_cell(grid, 0, grid->height), 1, south_north_type, heatsim->rank_north_peer, 0, heatsim->communicator, &request[4]);
-    if (err != MPI_SUCCESS) {
+    if (north_remote) {
+        err = MPI_Irecv(grid_get_cell(grid, 0, grid->height), 1, south_north_type, heatsim->rank_north_peer, 0, heatsim->communicator, &request[4]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_ISEND north");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
 
     //South
-    err = MPI_Irecv(grid_get_cell(grid, 0, -1), 1, south_north_type, heatsim->rank_south_peer, 1, heatsim->communicator, &request[5]);
-    if (err != MPI_SUCCESS) {
+    if (south_remote) {
+        err = MPI_Irecv(grid_get_cell(grid, 0, -1), 1, south_north_type, heatsim->rank_south_peer, 1, heatsim->communicator, &request[5]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_Irecv south");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
     //West
-    err = MPI_Irecv(grid_get_cell(grid, -1, 0), 1, east_west_type, heatsim->rank_west_peer, 1, heatsim->communicator, &request[6]);
-    if (err != MPI_SUCCESS) {
+    if (west_remote) {
+        err = MPI_Irecv(grid_get_cell(grid, -1, 0), 1, east_west_type, heatsim->rank_west_peer, 1, heatsim->communicator, &request[6]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_Irecv west");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
     }
 
 
     //East
-    err = MPI_Irecv(grid_get_cell(grid, grid->width, 0), 1, east_west_type, heatsim->rank_east_peer, 0, heatsim->communicator, &request[7]);
-    if (err != MPI_SUCCESS) {
+    if (east_remote) {
+        err = MPI_Irecv(grid_get_cell(grid, grid->width, 0), 1, east_west_type, heatsim->rank_east_peer, 0, heatsim->communicator, &request[7]);
+        if (err != MPI_SUCCESS) {
 		printf("error MPI_Irecv east");
-        goto fail_exit; 
+            goto fail_exit; 
+        }
+    }
+
+    //Without unpacking, the caller reads the neighbours' borders from the window
+    if (shared_exchange.enabled) {
+        shared_exchange_wait();
+        if (unpack) {
+            shared_exchange_unpack(grid);
+            shared_exchange_release();
+        }
     }
 
     err = MPI_Waitall(8, request, status);
@@ -341,7 +1105,465 @@ fail_exit:
     return -1;
 }
 
-int heatsim_send_result(heatsim_t* heatsim, grid_t* grid) {
+static int heatsim_exchange_borders_timed(heatsim_t* heatsim, grid_t* grid, bool unpack) {
+    double start = profile_begin();
+    int result = heatsim_exchange_borders_untimed(heatsim, grid, unpack);
+    profile_end(REGION_EXCHANGE, start);
+    return result;
+}
+
+int heatsim_exchange_borders(heatsim_t* heatsim, grid_t* grid) {
+    return heatsim_exchange_borders_timed(heatsim, grid, true);
+}
+
+// Maximum de deux résidus, sans dépendre de libm
+static inline double heatsim_max(double a, double b) {
+    return a > b ? a : b;
+}
+
+// Met à jour une cellule et retourne la valeur absolue de sa variation
+static inline double heatsim_stencil(grid_t* grid, grid_t* next, int x, int y) {
+    double center = *grid_get_cell(grid, x, y);
+    double north = *grid_get_cell(grid, x, y+1);
+    double south = *grid_get_cell(grid, x, y-1);
+    double east = *grid_get_cell(grid, x+1, y);
+    double west = *grid_get_cell(grid, x-1, y);
+    double value = (center + north + south + east + west) / 5.0;
+    *grid_get_cell(next, x, y) = value;
+    return fabs(value - center);
+}
+
+/*
+ * Voisins hors de la `grid`: le rembourrage, ou directement les bordures
+ * publiées dans la fenêtre partagée par les voisins du même noeud.
+ */
+struct heatsim_ghost_t
+{
+    const double* north;
+    const double* south;
+    const double* west;
+    const double* east;
+    int west_stride;
+    int east_stride;
+};
+
+static void heatsim_ghost_init(grid_t* grid, struct heatsim_ghost_t* ghost) {
+    ghost->north = grid_get_cell(grid, 0, grid->height);
+    ghost->south = grid_get_cell(grid, 0, -1);
+    ghost->west = grid_get_cell(grid, -1, 0);
+    ghost->east = grid_get_cell(grid, grid->width, 0);
+    ghost->west_stride = grid->width_padded;
+    ghost->east_stride = grid->width_padded;
+}
+
+// Remplace le rembourrage par les bordures des voisins du même noeud
+static void heatsim_ghost_shared(struct heatsim_ghost_t* ghost) {
+    if (shared_on_node(SHARED_NORTH)) {
+        ghost->north = shared_exchange_ghost(SHARED_NORTH);
+    }
+    if (shared_on_node(SHARED_SOUTH)) {
+        ghost->south = shared_exchange_ghost(SHARED_SOUTH);
+    }
+    if (shared_on_node(SHARED_WEST)) {
+        ghost->west = shared_exchange_ghost(SHARED_WEST);
+        ghost->west_stride = 1;
+    }
+    if (shared_on_node(SHARED_EAST)) {
+        ghost->east = shared_exchange_ghost(SHARED_EAST);
+        ghost->east_stride = 1;
+    }
+}
+
+// Cellule (x, y) de la `grid`, ou du voisin lorsqu'elle est hors de la `grid`
+static inline double heatsim_ghost_cell(grid_t* grid, const struct heatsim_ghost_t* ghost, int x, int y) {
+    if (y == (int)grid->height) {
+        return ghost->north[x];
+    }
+    if (y == -1) {
+        return ghost->south[x];
+    }
+    if (x == -1) {
+        return ghost->west[y * ghost->west_stride];
+    }
+    if (x == (int)grid->width) {
+        return ghost->east[y * ghost->east_stride];
+    }
+    return *grid_get_cell(grid, x, y);
+}
+
+// Même calcul que `heatsim_stencil`, en lisant les voisins par `ghost`
+static inline double heatsim_stencil_ghost(grid_t* grid, grid_t* next, const struct heatsim_ghost_t* ghost, int x, int y) {
+    double center = *grid_get_cell(grid, x, y);
+    double north = heatsim_ghost_cell(grid, ghost, x, y+1);
+    double south = heatsim_ghost_cell(grid, ghost, x, y-1);
+    double east = heatsim_ghost_cell(grid, ghost, x+1, y);
+    double west = heatsim_ghost_cell(grid, ghost, x-1, y);
+    double value = (center + north + south + east + west) / 5.0;
+    *grid_get_cell(next, x, y) = value;
+    return fabs(value - center);
+}
+
+/*
+ * Met à jour les cellules [x_begin, x_end) d'une rangée à partir des
+ * rangées `row`, `north` et `south`; `row[x_begin-1]` et `row[x_end]` doivent
+ * être valides. Les rangées sont contiguës, donc la boucle est vectorisée
+ * (AVX2/AVX-512 selon `-march`) en gardant l'ordre des additions de
+ * `heatsim_stencil`: le résultat est identique bit à bit.
+ */
+static inline double heatsim_stencil_row(const double* restrict row, const double* restrict north,
+                                         const double* restrict south, double* restrict out,
+                                         int x_begin, int x_end) {
+    double residual = 0;
+
+    #pragma omp simd reduction(max:residual)
+    for (int x = x_begin; x < x_end; x++) {
+        double value = (row[x] + north[x] + south[x] + row[x+1] + row[x-1]) / 5.0;
+        out[x] = value;
+        double delta = fabs(value - row[x]);
+        residual = delta > residual ? delta : residual;
+    }
+    return residual;
+}
+
+/*
+ * Intérieur de la `grid` (ne lit pas le rembourrage), rangée par rangée.
+ * Une rangée ne lit que ses deux voisines, qui restent en cache: découper
+ * en tuiles ne réduirait pas le trafic mémoire. Appelée dans une région
+ * parallèle, les rangées sont partagées entre les fils et chaque fil
+ * retourne le résidu de ses rangées.
+ */
+static double heatsim_update_interior(grid_t* grid, grid_t* next) {
+    int width = grid->width;
+    int height = grid->height;
+    double residual = 0;
+
+    #pragma omp for schedule(dynamic, 8) nowait
+    for (int y = 1; y < height - 1; y++) {
+        residual = heatsim_max(residual, heatsim_stencil_row(grid_get_cell(grid, 0, y), grid_get_cell(grid, 0, y+1),
+                                                             grid_get_cell(grid, 0, y-1), grid_get_cell(next, 0, y),
+                                                             1, width - 1));
+    }
+    return residual;
+}
+
+// Morceaux des rangées complètes du bord partagés entre les fils
+#define ROW_CHUNK 1024
+
+/*
+ * Première et dernière rangées et colonnes, qui lisent les voisins par
+ * `ghost`. Les deux rangées complètes sont découpées en morceaux pour que
+ * tous les fils y participent; les colonnes ne coûtent que deux cellules
+ * par rangée.
+ */
+static double heatsim_update_borders(grid_t* grid, grid_t* next, const struct heatsim_ghost_t* ghost) {
+    int width = grid->width;
+    int height = grid->height;
+    int rows = height > 1 ? 2 : 1;
+    int chunks = (width - 2 + ROW_CHUNK - 1) / ROW_CHUNK;
+    double residual = 0;
+
+    #pragma omp for collapse(2) schedule(dynamic) nowait
+    for (int row = 0; row < rows; row++) {
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            int y = row == 0 ? 0 : height - 1;
+            int x_begin = 1 + chunk * ROW_CHUNK;
+            int x_end = x_begin + ROW_CHUNK < width - 1 ? x_begin + ROW_CHUNK : width - 1;
+            const double* north = y == height - 1 ? ghost->north : grid_get_cell(grid, 0, y+1);
+            const double* south = y == 0 ? ghost->south : grid_get_cell(grid, 0, y-1);
+            residual = heatsim_max(residual, heatsim_stencil_row(grid_get_cell(grid, 0, y), north, south,
+                                                                 grid_get_cell(next, 0, y), x_begin, x_end));
+        }
+    }
+
+    #pragma omp for schedule(static)
+    for (int y = 0; y < height; y++) {
+        residual = heatsim_max(residual, heatsim_stencil_ghost(grid, next, ghost, 0, y));
+        if (width > 1) {
+            residual = heatsim_max(residual, heatsim_stencil_ghost(grid, next, ghost, width - 1, y));
+        }
+    }
+    return residual;
+}
+
+int heatsim_step_hybrid(heatsim_t* heatsim, grid_t* grid, grid_t* next, double* residual) {
+    assert(grid->padding == 1);
+    assert(grid->width == next->width && grid->height == next->height);
+
+    /*
+     * Mode hybride MPI + OpenMP: un rang par socket ou par noeud
+     * (`mpirun --map-by socket --bind-to socket`) et `OMP_NUM_THREADS`
+     * fils par rang. Avec au moins `MPI_THREAD_FUNNELED`, le fil maître
+     * échange les bordures pendant que les autres fils calculent
+     * l'intérieur, qui ne dépend pas du rembourrage. Les bordures de la
+     * `grid` sont calculées après l'échange.
+     */
+    int err = 0;
+    bool overlap = thread_level >= MPI_THREAD_FUNNELED;
+    struct heatsim_ghost_t ghost;
+
+    if (!overlap) {
+        err = heatsim_exchange_borders_timed(heatsim, grid, false);
+        if (err < 0) {
+            goto fail_exit;
+        }
+        heatsim_ghost_init(grid, &ghost);
+        heatsim_ghost_shared(&ghost);
+    }
+
+    double local_residual = 0;
+    double start = profile_begin();
+
+    #pragma omp parallel reduction(max:local_residual)
+    {
+        if (overlap) {
+            #pragma omp master
+            {
+                err = heatsim_exchange_borders_timed(heatsim, grid, false);
+                heatsim_ghost_init(grid, &ghost);
+                heatsim_ghost_shared(&ghost);
+            }
+        }
+
+        //Interior
+        local_residual = heatsim_max(local_residual, heatsim_update_interior(grid, next));
+
+        #pragma omp barrier
+
+        //Borders
+        local_residual = heatsim_max(local_residual, heatsim_update_borders(grid, next, &ghost));
+    }
+
+    profile_end(REGION_COMPUTE, start);
+    shared_exchange_release();
+
+    if (residual != NULL) {
+        *residual = local_residual;
+    }
+    if (err < 0) {
+        goto fail_exit;
+    }
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+int heatsim_check_convergence(heatsim_t* heatsim, double residual) {
+    /*
+     * Appelé par tous les rangs après chaque étape avec le résidu local
+     * (par exemple celui de `heatsim_step_hybrid`). Retourne 1 lorsque le
+     * résidu global est sous la tolérance, 0 pour continuer et -1 en cas
+     * d'erreur. Tous les rangs obtiennent la même décision.
+     */
+    int err;
+
+    if (convergence.tolerance <= 0) {
+        return 0;
+    }
+    convergence.step++;
+
+    //Reduction started on a previous step, overlapped with this step's exchange
+    if (convergence.pending) {
+        err = MPI_Wait(&convergence.request, MPI_STATUS_IGNORE);
+        convergence.pending = false;
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Wait residual");
+            goto fail_exit; 
+        }
+        if (convergence.global_residual < convergence.tolerance) {
+            return 1;
+        }
+    }
+
+    if (convergence.step % convergence.interval == 0) {
+        convergence.local_residual = residual;
+        err = MPI_Iallreduce(&convergence.local_residual, &convergence.global_residual, 1, MPI_DOUBLE, MPI_MAX, heatsim->communicator, &convergence.request);
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Iallreduce residual");
+            goto fail_exit; 
+        }
+        convergence.pending = true;
+    }
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+int heatsim_check_convergence_finish(void) {
+    int err;
+
+    if (convergence.pending) {
+        err = MPI_Wait(&convergence.request, MPI_STATUS_IGNORE);
+        convergence.pending = false;
+        if (err != MPI_SUCCESS) {
+		    printf("error MPI_Wait residual");
+            goto fail_exit; 
+        }
+    }
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+// Met le rembourrage à zéro; les noyaux n'y écrivent jamais
+static void heatsim_clear_padding(grid_t* grid) {
+    memset(grid_get_cell(grid, -1, -1), 0, grid->width_padded * sizeof(double));
+    memset(grid_get_cell(grid, -1, grid->height), 0, grid->width_padded * sizeof(double));
+    for (unsigned int y = 0; y < grid->height; y++) {
+        *grid_get_cell(grid, -1, y) = 0;
+        *grid_get_cell(grid, grid->width, y) = 0;
+    }
+}
+
+static void heatsim_destroy_grids(grid_t** grids, int count) {
+    for (int i = 0; i < count; i++) {
+        if (grids[i] != NULL) {
+            grid_destroy(grids[i]);
+        }
+    }
+}
+
+int heatsim_benchmark_kernel(const unsigned int* sizes, int size_count, int steps) {
+    /*
+     * Compare, pour chaque taille de `grid` carrée, la mise à jour cellule
+     * par cellule (`heatsim_stencil`) au noyau par rangées de
+     * `heatsim_step_hybrid`, sans échange de bordures (rembourrage nul).
+     * Les deux versions s'exécutent sur le fil appelant, hors de toute
+     * région parallèle. L'accélération combine la vectorisation et l'accès
+     * direct aux rangées au lieu de `grid_get_cell`. Sous une centaine de
+     * cellules de côté, le coût fixe des boucles OpenMP du noyau domine.
+     * Vérifie que les résultats sont identiques bit à bit et affiche le
+     * débit en millions de cellules par seconde.
+     */
+    int err = 0;
+
+    printf("%-10s %14s %14s %8s %10s\n", "size", "reference", "rows", "speedup", "identical");
+    for (int i = 0; i < size_count; i++) {
+        unsigned int size = sizes[i];
+        grid_t* grids[4] = {grid_create(size, size, 1), grid_create(size, size, 1),
+                            grid_create(size, size, 1), grid_create(size, size, 1)};
+        grid_t** reference = &grids[0];
+        grid_t** rows = &grids[2];
+        if (grids[0] == NULL || grids[1] == NULL || grids[2] == NULL || grids[3] == NULL) {
+            LOG_ERROR_NULL_PTR();
+            heatsim_destroy_grids(grids, 4);
+            err = -1;
+            break;
+        }
+
+        for (int j = 0; j < 4; j++) {
+            heatsim_clear_padding(grids[j]);
+        }
+        for (unsigned int y = 0; y < size; y++) {
+            for (unsigned int x = 0; x < size; x++) {
+                double value = (double)((x * 7 + y * 13) % 101);
+                *grid_get_cell(reference[0], x, y) = value;
+                *grid_get_cell(rows[0], x, y) = value;
+            }
+        }
+
+        double start = MPI_Wtime();
+        for (int step = 0; step < steps; step++) {
+            for (unsigned int y = 0; y < size; y++) {
+                for (unsigned int x = 0; x < size; x++) {
+                    heatsim_stencil(reference[step % 2], reference[(step + 1) % 2], x, y);
+                }
+            }
+        }
+        double reference_time = MPI_Wtime() - start;
+
+        //Outside a parallel region the worksharing loops run on this thread only
+        start = MPI_Wtime();
+        for (int step = 0; step < steps; step++) {
+            struct heatsim_ghost_t ghost;
+            heatsim_ghost_init(rows[step % 2], &ghost);
+            heatsim_update_interior(rows[step % 2], rows[(step + 1) % 2]);
+            heatsim_update_borders(rows[step % 2], rows[(step + 1) % 2], &ghost);
+        }
+        double rows_time = MPI_Wtime() - start;
+
+        bool identical = true;
+        for (unsigned int y = 0; y < size && identical; y++) {
+            identical = memcmp(grid_get_cell(reference[steps % 2], 0, y), grid_get_cell(rows[steps % 2], 0, y), size * sizeof(double)) == 0;
+        }
+
+        double cells = (double)size * size * steps / 1e6;
+        printf("%-10u %10.1f M/s %10.1f M/s %7.2fx %10s\n", size, cells / reference_time, cells / rows_time,
+               reference_time / rows_time, identical ? "yes" : "no");
+        if (!identical) {
+            err = -1;
+        }
+
+        heatsim_destroy_grids(grids, 4);
+    }
+
+    return err;
+}
+
+int heatsim_profile_report(heatsim_t* heatsim) {
+    /*
+     * Collectif: agrège les temps de chaque région sur tous les rangs et
+     * les affiche sur le rang 0. Le déséquilibre est `max / moy - 1`.
+     */
+    int err;
+    double min[REGION_COUNT];
+    double max[REGION_COUNT];
+    double sum[REGION_COUNT];
+    unsigned long calls[REGION_COUNT];
+
+    if (!profile.enabled) {
+        return 0;
+    }
+    profile.total[REGION_TOTAL] = MPI_Wtime() - profile.origin;
+    profile.count[REGION_TOTAL] = 1;
+
+    err = MPI_Reduce(profile.count, calls, REGION_COUNT, MPI_UNSIGNED_LONG, MPI_SUM, 0, heatsim->communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Reduce profile count");
+        goto fail_exit; 
+    }
+
+    err = MPI_Reduce(profile.total, min, REGION_COUNT, MPI_DOUBLE, MPI_MIN, 0, heatsim->communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Reduce profile min");
+        goto fail_exit; 
+    }
+    err = MPI_Reduce(profile.total, max, REGION_COUNT, MPI_DOUBLE, MPI_MAX, 0, heatsim->communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Reduce profile max");
+        goto fail_exit; 
+    }
+    err = MPI_Reduce(profile.total, sum, REGION_COUNT, MPI_DOUBLE, MPI_SUM, 0, heatsim->communicator);
+    if (err != MPI_SUCCESS) {
+		printf("error MPI_Reduce profile sum");
+        goto fail_exit; 
+    }
+
+    if (heatsim->rank == 0) {
+        printf("%-12s %12s %12s %12s %10s %10s %14s\n", "region", "min (s)", "avg (s)", "max (s)", "imbalance", "calls", "per call (us)");
+        for (int region = 0; region < REGION_COUNT; region++) {
+            double avg = sum[region] / heatsim->rank_count;
+            double imbalance = avg > 0 ? max[region] / avg - 1 : 0;
+            double avg_calls = (double)calls[region] / heatsim->rank_count;
+            double per_call = calls[region] > 0 ? sum[region] / calls[region] * 1e6 : 0;
+            printf("%-12s %12.6f %12.6f %12.6f %9.1f%% %10.0f %14.2f\n", region_names[region], min[region], avg, max[region],
+                   imbalance * 100, avg_calls, per_call);
+        }
+    }
+
+    if (profile.trace != NULL) {
+        fclose(profile.trace);
+        profile.trace = NULL;
+    }
+    return 0;
+
+fail_exit:
+    return -1;
+}
+
+static int heatsim_send_result_untimed(heatsim_t* heatsim, grid_t* grid) {
     assert(grid->padding == 0);
     int err;
     /*
@@ -365,7 +1587,14 @@ fail_exit:
     return -1;
 }
 
-int heatsim_receive_results(heatsim_t* heatsim, cart2d_t* cart) {
+int heatsim_send_result(heatsim_t* heatsim, grid_t* grid) {
+    double start = profile_begin();
+    int result = heatsim_send_result_untimed(heatsim, grid);
+    profile_end(REGION_COLLECT, start);
+    return result;
+}
+
+static int heatsim_receive_results_untimed(heatsim_t* heatsim, cart2d_t* cart) {
     /*
      * TODO: Recevoir toutes les `grid` des autres rangs. Aucune `grid`
      *       n'a de rembourage (padding = 0).
@@ -398,3 +1627,10 @@ int heatsim_receive_results(heatsim_t* heatsim, cart2d_t* cart) {
 fail_exit:
     return -1;
 }
+
+int heatsim_receive_results(heatsim_t* heatsim, cart2d_t* cart) {
+    double start = profile_begin();
+    int result = heatsim_receive_results_untimed(heatsim, cart);
+    profile_end(REGION_COLLECT, start);
+    return result;
+}
@@ -0,0 +1,123 @@
+#!/bin/sh
+#
+# Balayage de mise à l'échelle forte et faible de heatsim avec `mpirun`.
+#
+# Usage: heatsim-scaling.sh strong|weak MAX_RANKS WIDTH HEIGHT COMMANDE...
+#
+# La commande peut contenir les jetons {N}, {DX}, {DY}, {W} et {H}, remplacés
+# à chaque exécution par le nombre de rangs, la grille de processus et les
+# dimensions globales. En mise à l'échelle forte, WIDTH x HEIGHT est fixe; en
+# mise à l'échelle faible, c'est la taille par rang (la grille globale croît
+# avec DX x DY). L'efficacité est T1 / (N * TN) en forte et T1 / TN en faible.
+#
+# Exemple:
+#   ./heatsim-scaling.sh strong 8 1024 1024 ./heatsim --dim-x {DX} --dim-y {DY} \
+#       --width {W} --height {H} --iterations 1000
+#
+# HEATSIM_PROFILE=1 est exporté pour que chaque exécution affiche le
+# détail par région (voir `heatsim_profile_report`). Le temps retenu est le
+# maximum de la ligne `total` de ce rapport, ce qui exclut le lancement de
+# `mpirun`; si le programme n'affiche pas le rapport, le temps mur autour de
+# `mpirun` est utilisé et marqué `*`. Les jetons sont remplacés argument par
+# argument, les arguments contenant des espaces sont donc préservés.
+# MPIRUN et MPIRUN_FLAGS permettent de changer le lanceur; MPIRUN_FLAGS est
+# découpé aux espaces.
+
+set -e
+
+if [ $# -lt 5 ]; then
+    echo "usage: $0 strong|weak MAX_RANKS WIDTH HEIGHT COMMAND..." >&2
+    exit 1
+fi
+
+mode=$1
+max_ranks=$2
+width=$3
+height=$4
+shift 4
+
+case $mode in
+    strong|weak) ;;
+    *) echo "mode must be strong or weak" >&2; exit 1 ;;
+esac
+
+MPIRUN=${MPIRUN:-mpirun}
+export HEATSIM_PROFILE=1
+
+# Grille de processus la plus carrée possible pour N rangs
+dims() {
+    dx=1
+    i=1
+    while [ $((i * i)) -le $1 ]; do
+        if [ $(($1 % i)) -eq 0 ]; then
+            dx=$i
+        fi
+        i=$((i + 1))
+    done
+    echo "$(($1 / dx)) $dx"
+}
+
+now() {
+    date +%s.%N
+}
+
+# Lance la commande sur $n rangs en remplaçant les jetons de chaque argument
+run() {
+    count=$#
+    while [ "$count" -gt 0 ]; do
+        arg=$(printf '%s\n' "$1" | sed -e "s/{N}/$n/g" -e "s/{DX}/$dx/g" -e "s/{DY}/$dy/g" \
+                                         -e "s/{W}/$w/g" -e "s/{H}/$h/g")
+        shift
+        set -- "$@" "$arg"
+        count=$((count - 1))
+    done
+    $MPIRUN $MPIRUN_FLAGS -np "$n" "$@"
+}
+
+printf "%-6s %-8s %-12s %-10s %-10s %-10s\n" "ranks" "grid" "size" "time (s)" "speedup" "efficiency"
+
+reference=""
+n=1
+while [ "$n" -le "$max_ranks" ]; do
+    set -- $(dims "$n") "$@"
+    dx=$1
+    dy=$2
+    shift 2
+
+    if [ "$mode" = "strong" ]; then
+        w=$width
+        h=$height
+    else
+        w=$((width * dx))
+        h=$((height * dy))
+    fi
+
+    start=$(now)
+    output=$(run "$@")
+    end=$(now)
+    if [ -n "$output" ]; then
+        printf '%s\n' "$output" >&2
+    fi
+
+    elapsed=$(printf '%s\n' "$output" | awk '$1 == "total" { print $4 }')
+    marker=""
+    if [ -z "$elapsed" ]; then
+        elapsed=$(awk "BEGIN { print $end - $start }")
+        marker="*"
+    fi
+
+    if [ -z "$reference" ]; then
+        reference=$elapsed
+    fi
+    speedup=$(awk "BEGIN { print $reference / $elapsed }")
+    if [ "$mode" = "strong" ]; then
+        efficiency=$(awk "BEGIN { print $speedup / $n }")
+    else
+        efficiency=$speedup
+    fi
+
+    printf "%-6d %-8s %-12s %-10s %-10.2f %-10.2f\n" "$n" "${dx}x${dy}" "${w}x${h}" \
+        "$(printf "%.3f" "$elapsed")$marker" "$speedup" "$efficiency"
+
+    n=$((n * 2))
+done